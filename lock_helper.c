@@ -1,12 +1,18 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <signal.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/stat.h>
 #include <linux/vt.h>
 #include <fcntl.h>
+#include <errno.h>
 
 #include <X11/Xlib.h>
 #include <X11/XKBlib.h>
@@ -20,30 +26,159 @@
 #include <pulse/pulseaudio.h>
 #include <pulse/glib-mainloop.h>
 
+#include "lock_trace.h"
+
 #define SYSRQ_PATH "/proc/sys/kernel/sysrq"
 #define MAGIC_TERMINATE_OPTION "terminate:ctrl_alt_bksp"
 
+// Restoring the keymap on unlock is deferred by this much, and then waits for no keys to have been held for
+// KEYBOARD_IDLE_MS (but never longer than KEYBOARD_IDLE_MAX_WAIT_MS) so it doesn't land on top of typing
+#define KEYMAP_RESTORE_DELAY_MS 500
+#define KEYBOARD_IDLE_MS 250
+#define KEYBOARD_IDLE_POLL_MS 25
+#define KEYBOARD_IDLE_MAX_WAIT_MS 3000
+
+// Shared with the keymap child. A restore that a lock catches still waiting for the keyboard is called off
+// by moving it from PENDING to CANCELLED; the child only reloads if it gets to move it to STARTED first.
+#define KEYMAP_RELOAD_PENDING 0
+#define KEYMAP_RELOAD_STARTED 1
+#define KEYMAP_RELOAD_CANCELLED 2
+
+typedef struct {
+    gint state;
+    gint64 start;
+    gint64 end;
+} KeymapReloadRec;
+
+#define JOURNAL_DIR "/run/lock_helper"
+#define JOURNAL_MAGIC 0x314a484c // "LHJ1"
+#define JOURNAL_VERSION 1
+
+// Where each hardening step was last left. A step is marked JOURNAL_CHANGING before it's touched and only
+// marked with where it ended up once that's known, so a crash can only ever leave it CHANGING, never wrong.
+#define JOURNAL_CLEAR 0
+#define JOURNAL_CHANGING 1
+#define JOURNAL_HARDENED 2
+
+enum {
+    JOURNAL_VT,
+    JOURNAL_SYSRQ,
+    JOURNAL_KEYMAP,
+    JOURNAL_N_STEPS
+};
+
+// Memory-mapped from a root-only tmpfs dir, so it outlives us if we're killed while the screen is locked.
+// Everything after the steps is the state from before any hardening, only written while all steps are clear.
+typedef struct {
+    guint32 magic;
+    guint32 version;
+    gint steps[JOURNAL_N_STEPS];
+    gint originals_valid;
+    gint modify_sysrq;
+    char orig_sysrq[4];
+    gint modify_x11_layout_options;
+    gint has_extra_x11_layout_options;
+    char extra_x11_layout_options[512];
+} JournalRec;
+
 static uid_t orig_user;
 static GMainLoop *loop = NULL;
 static GDBusProxy *screensaver_proxy = NULL;
 static GDBusProxy *upower_proxy = NULL;
 static int term = -1;
 
+static JournalRec *journal = NULL;
+static int journal_fd = -1;
+static gboolean journal_recovered = FALSE;
+
 static char orig_sysrq[4];
 static gboolean modify_sysrq;
 
 static gboolean modify_x11_layout_options;
 static gchar *extra_x11_layout_options = NULL;
 
+// What the screensaver last asked for vs. what the keymap and audio were last set up for
+static gboolean desired_locked = FALSE;
+static gboolean applied_locked = FALSE;
+static guint apply_source_id = 0;
+static guint skipped_transitions = 0;
+static gint64 unlocked_at = 0;
+static KeymapReloadRec *keymap_reload = NULL;
+
+// An X-side operation running in a child process. It's reaped asynchronously and killed if it overruns
+// x11_timeout, so a wedged X server can hold up neither the main loop nor the next lock.
+typedef struct {
+    const gchar *name;
+    GPid pid;
+    guint watchdog_id;
+    void (*finished)(gboolean success);
+} X11Op;
+
+static gint x11_timeout = 10;
+static guint x11_failures = 0;
+
 static gboolean pulse_ready = FALSE;
 static pa_glib_mainloop *pa_loop = NULL;
 static pa_context *pa_ctx = NULL;
 static gchar *default_sink = NULL;
+static gchar *muted_sink = NULL;
+
+// What a server info lookup is for
+enum {
+    SINK_REFRESH,
+    SINK_MUTE,
+    // Only mutes if the sink isn't muted already and the screen is still locked, so unlocking can undo it
+    SINK_MUTE_FOR_LOCK
+};
 
 // Fucking GNOME...
 static GDBusProxy *gnome_session_main_proxy = NULL;
 static GDBusProxy *gnome_session_client_proxy = NULL;
 
+// For lock_replay: --dry-run leaves the VT and sysrq alone and doesn't need root, --trace records what happened
+static gboolean dry_run = FALSE;
+static gchar *trace_path = NULL;
+static int trace_fd = -1;
+static gint64 trace_start = 0;
+
+static void trace_close()
+{
+    if (trace_fd != -1) {
+        g_close(trace_fd, NULL);
+        trace_fd = -1;
+    }
+}
+
+static gboolean trace_open()
+{
+    LockTraceHeader header = { LOCK_TRACE_MAGIC, g_get_monotonic_time() };
+
+    if ((trace_fd = g_open(trace_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) == -1) {
+        perror("Failed to open() the trace file");
+        return FALSE;
+    }
+
+    if (write(trace_fd, &header, sizeof(header)) != sizeof(header)) {
+        perror("Failed to write() the trace header");
+        trace_close();
+        return FALSE;
+    }
+    trace_start = header.start;
+
+    return TRUE;
+}
+
+static void trace(guint16 event, gboolean arg)
+{
+    LockTraceRec rec = { g_get_monotonic_time() - trace_start, event, !!arg, 0 };
+
+    // One write() per record, so a trace cut short by a crash is still whole up to that point
+    if (trace_fd != -1 && write(trace_fd, &rec, sizeof(rec)) != sizeof(rec)) {
+        perror("Failed to write() to the trace file, no longer tracing");
+        trace_close();
+    }
+}
+
 static void deinit_pulse()
 {
     pulse_ready = FALSE;
@@ -55,13 +190,31 @@ static void deinit_pulse()
 
     g_clear_pointer(&pa_loop, pa_glib_mainloop_free);
     g_clear_pointer(&default_sink, g_free);
+    g_clear_pointer(&muted_sink, g_free);
+}
+
+static void pa_sink_info_callback(pa_context *context, const pa_sink_info *i, int eol, void *userdata)
+{
+    if (eol || !i)
+        return;
+
+    if (GPOINTER_TO_INT(userdata) == SINK_MUTE_FOR_LOCK) {
+        if (i->mute || !desired_locked)
+            return;
+
+        g_free(muted_sink);
+        muted_sink = g_strdup(i->name);
+    }
+
+    pa_operation_unref(pa_context_set_sink_mute_by_name(context, i->name, 1, NULL, NULL));
+    trace(LOCK_TRACE_MUTE, TRUE);
 }
 
 static void pa_server_info_callback(pa_context *context, const pa_server_info *i, void *userdata)
 {
     if (i->default_sink_name) {
-        if (GPOINTER_TO_INT(userdata))
-            pa_operation_unref(pa_context_set_sink_mute_by_name(context, i->default_sink_name, 1, NULL, NULL));
+        if (GPOINTER_TO_INT(userdata) != SINK_REFRESH)
+            pa_operation_unref(pa_context_get_sink_info_by_name(context, i->default_sink_name, pa_sink_info_callback, userdata));
 
         if (!default_sink || g_strcmp0(default_sink, i->default_sink_name)) {
             g_free(default_sink);
@@ -72,18 +225,35 @@ static void pa_server_info_callback(pa_context *context, const pa_server_info *i
 
 static void context_state_callback(pa_context *context, void *userdata G_GNUC_UNUSED)
 {
-    if ((pulse_ready = pa_context_get_state(context) == PA_CONTEXT_READY))
-        pa_operation_unref(pa_context_get_server_info(pa_ctx, pa_server_info_callback, GINT_TO_POINTER(FALSE)));
+    pa_context_state_t state = pa_context_get_state(context);
+
+    if (state == PA_CONTEXT_READY || state == PA_CONTEXT_FAILED || state == PA_CONTEXT_TERMINATED)
+        trace(LOCK_TRACE_PULSE_READY, state == PA_CONTEXT_READY);
+
+    if ((pulse_ready = state == PA_CONTEXT_READY))
+        pa_operation_unref(pa_context_get_server_info(pa_ctx, pa_server_info_callback, GINT_TO_POINTER(SINK_REFRESH)));
 }
 
 static void mute_sound(gboolean attempt_now)
 {
     // Many thanks to https://kdekorte.blogspot.com/2010/11/getting-default-volume-from-pulseaudio.html
     if (pulse_ready) {
-        if (attempt_now && default_sink)
+        if (attempt_now && default_sink) {
             pa_operation_unref(pa_context_set_sink_mute_by_name(pa_ctx, default_sink, 1, NULL, NULL));
-        else
-            pa_operation_unref(pa_context_get_server_info(pa_ctx, pa_server_info_callback, GINT_TO_POINTER(TRUE)));
+            trace(LOCK_TRACE_MUTE, TRUE);
+        } else
+            pa_operation_unref(pa_context_get_server_info(pa_ctx, pa_server_info_callback, GINT_TO_POINTER(attempt_now ? SINK_MUTE : SINK_MUTE_FOR_LOCK)));
+    }
+}
+
+static void unmute_sound()
+{
+    if (muted_sink) {
+        if (pulse_ready) {
+            pa_operation_unref(pa_context_set_sink_mute_by_name(pa_ctx, muted_sink, 0, NULL, NULL));
+            trace(LOCK_TRACE_MUTE, FALSE);
+        }
+        g_clear_pointer(&muted_sink, g_free);
     }
 }
 
@@ -103,6 +273,7 @@ static void init_pulse()
 static void lock_originating_session()
 {
     g_variant_unref(g_dbus_proxy_call_sync(screensaver_proxy, "Lock", NULL, G_DBUS_CALL_FLAGS_NONE, -1, NULL, NULL));
+    trace(LOCK_TRACE_LOCK_CALLED, TRUE);
 }
 
 static void on_lid_closed(GDBusProxy *proxy G_GNUC_UNUSED, GVariant *changed_properties, GStrv invalidated_properties G_GNUC_UNUSED, gpointer user_data G_GNUC_UNUSED) {
@@ -116,6 +287,7 @@ static void on_lid_closed(GDBusProxy *proxy G_GNUC_UNUSED, GVariant *changed_pro
         v = g_variant_dict_lookup_value(&dict, "LidIsClosed", G_VARIANT_TYPE_BOOLEAN);
         lid_closed = g_variant_get_boolean(v);
         g_variant_unref(v);
+        trace(LOCK_TRACE_UPOWER_LID_CLOSED, lid_closed);
     }
 
     if (lid_closed)
@@ -130,36 +302,125 @@ static void upower_init()
 
 static void gnome_session_unregister();
 
+static void gnome_session_all_is_ok()
+{
+    g_variant_unref(g_dbus_proxy_call_sync(gnome_session_client_proxy, "EndSessionResponse", g_variant_new ("(bs)", TRUE, ""), G_DBUS_CALL_FLAGS_NONE, -1, NULL, NULL));
+    trace(LOCK_TRACE_END_SESSION_RESPONSE, TRUE);
+}
+
 static void child_setup(gpointer user_data G_GNUC_UNUSED)
 {
     if (setuid(orig_user) != 0)
         exit(EXIT_FAILURE);
 }
 
-static void gnome_session_all_is_ok()
+static void x11_op_cancel_watchdog(X11Op *op)
 {
-    g_variant_unref(g_dbus_proxy_call_sync(gnome_session_client_proxy, "EndSessionResponse", g_variant_new ("(bs)", TRUE, ""), G_DBUS_CALL_FLAGS_NONE, -1, NULL, NULL));
+    if (op->watchdog_id) {
+        g_source_remove(op->watchdog_id);
+        op->watchdog_id = 0;
+    }
+}
+
+static void x11_op_finish(X11Op *op, gboolean success)
+{
+    x11_op_cancel_watchdog(op);
+    op->pid = 0;
+
+    if (!success) {
+        ++x11_failures;
+        g_printerr("%s failed (%u failed X operations so far)\n", op->name, x11_failures);
+    }
+
+    op->finished(success);
+}
+
+static void on_x11_op_exited(GPid pid, gint status, gpointer user_data)
+{
+    X11Op *op = user_data;
+
+    g_spawn_close_pid(pid);
+
+    // Already given up on by the watchdog
+    if (pid != op->pid)
+        return;
+
+    x11_op_finish(op, WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+}
+
+static gboolean on_x11_op_timeout(gpointer user_data)
+{
+    X11Op *op = user_data;
+
+    op->watchdog_id = 0;
+    g_printerr("%s did not finish within %d seconds, killing it\n", op->name, x11_timeout);
+    kill(op->pid, SIGKILL);
+
+    // Don't wait for the child to be reaped: something stuck talking to the X server needn't die promptly.
+    // The child watch stays in place to reap it whenever it does go.
+    x11_op_finish(op, FALSE);
+
+    return G_SOURCE_REMOVE;
+}
+
+static void x11_op_abandon(X11Op *op)
+{
+    x11_op_cancel_watchdog(op);
+    kill(op->pid, SIGKILL);
+
+    // The child watch stays in place to reap it, and ignores it once it does
+    op->pid = 0;
+}
+
+static void x11_op_watch(X11Op *op, GPid pid)
+{
+    op->pid = pid;
+    g_child_watch_add(pid, on_x11_op_exited, op);
+    if (x11_timeout > 0)
+        op->watchdog_id = g_timeout_add_seconds(x11_timeout, on_x11_op_timeout, op);
 }
 
+static void gnome_session_end_finish(gboolean success G_GNUC_UNUSED)
+{
+    // Let anything already queued, like the mute, go out first, but never wait for something new to happen
+    for (int i = 0; i < 100 && g_main_context_iteration(NULL, FALSE); ++i)
+        ;
+
+    gnome_session_all_is_ok();
+    gnome_session_unregister();
+    g_main_loop_quit(loop);
+}
+
+static X11Op xkillall_op = { "xkillall", 0, 0, gnome_session_end_finish };
+
 static void gnome_session_on_signal(GDBusProxy *proxy G_GNUC_UNUSED, gchar *sender_name G_GNUC_UNUSED, gchar *signal_name, GVariant *parameters G_GNUC_UNUSED, gpointer user_data G_GNUC_UNUSED)
 {
     if (!g_strcmp0(signal_name, "Stop")) {
+        trace(LOCK_TRACE_SESSION_STOP, FALSE);
         gnome_session_unregister();
         g_main_loop_quit(loop);
     } else if (!g_strcmp0(signal_name, "QueryEndSession")) {
-        pa_operation_unref(pa_context_get_server_info(pa_ctx, pa_server_info_callback, GINT_TO_POINTER(FALSE)));
+        trace(LOCK_TRACE_SESSION_QUERY_END, FALSE);
+        pa_operation_unref(pa_context_get_server_info(pa_ctx, pa_server_info_callback, GINT_TO_POINTER(SINK_REFRESH)));
         gnome_session_all_is_ok();
     } else if (!g_strcmp0(signal_name, "EndSession")) {
         gchar *argv[] = { "/home/faheem/bin/xkillall", NULL };
-        mute_sound(TRUE);
-        g_spawn_sync(NULL, argv, NULL, G_SPAWN_DEFAULT, child_setup, NULL, NULL, NULL, NULL, NULL);
-        do
-            g_main_context_iteration(NULL, TRUE);
-        while (g_main_context_pending(NULL));
+        GPid pid;
 
-        gnome_session_all_is_ok();
-        gnome_session_unregister();
-        g_main_loop_quit(loop);
+        trace(LOCK_TRACE_SESSION_END, FALSE);
+
+        // Answered once xkillall is done with, from gnome_session_end_finish()
+        if (xkillall_op.pid)
+            return;
+
+        mute_sound(TRUE);
+        // A dry run only goes through the motions, and xkillall would take the user's session down for real
+        if (dry_run)
+            gnome_session_end_finish(TRUE);
+        else if (g_spawn_async(NULL, argv, NULL, G_SPAWN_DO_NOT_REAP_CHILD, child_setup, NULL, &pid, NULL))
+            x11_op_watch(&xkillall_op, pid);
+        else
+            gnome_session_end_finish(FALSE);
     }
 }
 
@@ -226,7 +487,7 @@ static gboolean read_sysrq()
         return FALSE;
     }
 
-    ssize_t nread = read(fd, orig_sysrq, sizeof(orig_sysrq));
+    ssize_t nread = read(fd, orig_sysrq, sizeof(orig_sysrq) - 1);
     if (nread == -1) {
         perror("Failed to read() " SYSRQ_PATH);
         g_close(fd, NULL);
@@ -241,6 +502,9 @@ static gboolean read_sysrq()
 
 static void write_sysrq(const char *val)
 {
+    if (dry_run)
+        return;
+
     int fd = g_open(SYSRQ_PATH, O_WRONLY);
     if (fd == -1) {
         perror("Failed to open() " SYSRQ_PATH " for writing");
@@ -255,6 +519,9 @@ static void write_sysrq(const char *val)
 
 static void lock_vt(gboolean lock)
 {
+    if (dry_run)
+        return;
+
     // Thanks to sflock
     if (term == -1)
         if ((term = g_open("/dev/console", O_RDONLY | O_NOCTTY | O_CLOEXEC)) == -1) {
@@ -266,6 +533,157 @@ static void lock_vt(gboolean lock)
         perror("VT_(UN)LOCKSWITCH");
 }
 
+static void journal_set(int step, gint state)
+{
+    if (journal)
+        g_atomic_int_set(&journal->steps[step], state);
+}
+
+static void journal_open()
+{
+    // What's in here ends up written to /proc as root, so it must live somewhere only root can touch
+    gchar *name = g_strdup_printf("%u.state", (guint) orig_user);
+    gchar *path = g_build_filename(JOURNAL_DIR, name, NULL);
+    struct stat st;
+    int dir_fd;
+
+    if (g_mkdir(JOURNAL_DIR, 0700) == -1 && errno != EEXIST) {
+        perror("Failed to mkdir() " JOURNAL_DIR);
+        goto out;
+    }
+
+    if ((dir_fd = g_open(JOURNAL_DIR, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) == -1) {
+        perror("Failed to open() " JOURNAL_DIR);
+        goto out;
+    }
+
+    if (fstat(dir_fd, &st) == -1 || st.st_uid != 0 || (st.st_mode & (S_IWGRP | S_IWOTH))) {
+        g_printerr(JOURNAL_DIR " isn't writable by root alone, running without a state journal\n");
+        g_close(dir_fd, NULL);
+        goto out;
+    }
+
+    journal_fd = openat(dir_fd, name, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+    g_close(dir_fd, NULL);
+    if (journal_fd == -1) {
+        perror("Failed to open() the state journal");
+        goto out;
+    }
+
+    if (fstat(journal_fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_uid != 0) {
+        g_printerr("%s isn't a file of root's, running without a state journal\n", path);
+        goto fail;
+    }
+
+    // The lock is held for as long as we run: whoever can't get it leaves the journal to its owner
+    if (flock(journal_fd, LOCK_EX | LOCK_NB) == -1) {
+        g_printerr("%s is in use by another instance, running without a state journal\n", path);
+        goto fail;
+    }
+
+    if (fstat(journal_fd, &st) == -1 || (st.st_size < (off_t) sizeof(JournalRec) && ftruncate(journal_fd, sizeof(JournalRec)) == -1)) {
+        perror("Failed to size the state journal");
+        goto fail;
+    }
+
+    journal = mmap(NULL, sizeof(JournalRec), PROT_READ | PROT_WRITE, MAP_SHARED, journal_fd, 0);
+    if (journal == MAP_FAILED) {
+        journal = NULL;
+        perror("Failed to mmap() the state journal");
+        goto fail;
+    }
+
+    if (journal->magic != JOURNAL_MAGIC || journal->version != JOURNAL_VERSION) {
+        memset(journal, 0, sizeof(JournalRec));
+        journal->magic = JOURNAL_MAGIC;
+        journal->version = JOURNAL_VERSION;
+    }
+    goto out;
+
+fail:
+    g_close(journal_fd, NULL);
+    journal_fd = -1;
+out:
+    g_free(path);
+    g_free(name);
+}
+
+static void journal_close()
+{
+    if (journal) {
+        munmap(journal, sizeof(JournalRec));
+        journal = NULL;
+    }
+
+    if (journal_fd != -1) {
+        g_close(journal_fd, NULL);
+        journal_fd = -1;
+    }
+}
+
+// Only ever something like "176" or "1\n" from /proc
+static gboolean sysrq_value_is_sane(const char *val)
+{
+    size_t digits = strspn(val, "0123456789");
+
+    return digits > 0 && digits < sizeof(orig_sysrq) && (!val[digits] || (val[digits] == '\n' && !val[digits + 1]));
+}
+
+// If a previous instance died with anything hardened, pick up the originals it recorded instead of
+// reading back what it left behind
+static gboolean journal_load_originals()
+{
+    gboolean dirty = FALSE;
+
+    if (!journal || !g_atomic_int_get(&journal->originals_valid))
+        return FALSE;
+
+    for (int i = 0; i < JOURNAL_N_STEPS; ++i)
+        if (g_atomic_int_get(&journal->steps[i]) != JOURNAL_CLEAR)
+            dirty = TRUE;
+    if (!dirty)
+        return FALSE;
+
+    modify_sysrq = journal->modify_sysrq;
+    memcpy(orig_sysrq, journal->orig_sysrq, sizeof(orig_sysrq));
+    orig_sysrq[sizeof(orig_sysrq) - 1] = '\0';
+    if (!sysrq_value_is_sane(orig_sysrq)) {
+        g_printerr("Ignoring the state journal: it has a bogus sysrq value\n");
+        return FALSE;
+    }
+
+    modify_x11_layout_options = journal->modify_x11_layout_options;
+    journal->extra_x11_layout_options[sizeof(journal->extra_x11_layout_options) - 1] = '\0';
+    if (journal->has_extra_x11_layout_options)
+        extra_x11_layout_options = g_strdup(journal->extra_x11_layout_options);
+
+    // Whatever state the keymap was left in, treat it as hardened so the state machine puts it back
+    applied_locked = modify_x11_layout_options && g_atomic_int_get(&journal->steps[JOURNAL_KEYMAP]) != JOURNAL_CLEAR;
+    journal_recovered = TRUE;
+
+    return TRUE;
+}
+
+static void journal_save_originals()
+{
+    if (!journal)
+        return;
+
+    g_atomic_int_set(&journal->originals_valid, FALSE);
+
+    journal->modify_sysrq = modify_sysrq;
+    memcpy(journal->orig_sysrq, orig_sysrq, sizeof(orig_sysrq));
+
+    journal->modify_x11_layout_options = modify_x11_layout_options;
+    journal->has_extra_x11_layout_options = extra_x11_layout_options != NULL;
+    if (extra_x11_layout_options && g_strlcpy(journal->extra_x11_layout_options, extra_x11_layout_options, sizeof(journal->extra_x11_layout_options)) >= sizeof(journal->extra_x11_layout_options)) {
+        g_printerr("X11 layout options are too long for the state journal, the keymap won't be recovered after a crash\n");
+        journal->modify_x11_layout_options = FALSE;
+    }
+
+    g_atomic_int_set(&journal->originals_valid, TRUE);
+}
+
 static gboolean must_we_mess_with_x11s_layout(gchar **extra_options)
 {
     gboolean has_terminate_ctrl_alt_bksp = FALSE;
@@ -314,11 +732,52 @@ static gboolean must_we_mess_with_x11s_layout(gchar **extra_options)
     return has_terminate_ctrl_alt_bksp;
 }
 
+static void wait_for_keyboard_idle(Display *dpy)
+{
+    gint64 max_wait_ms = KEYBOARD_IDLE_MAX_WAIT_MS;
+    gint64 idle_since = 0;
+
+    // Leave the reload itself at least half of what the watchdog allows
+    if (x11_timeout > 0 && x11_timeout * 500 < max_wait_ms)
+        max_wait_ms = x11_timeout * 500;
+
+    gint64 deadline = g_get_monotonic_time() + max_wait_ms * 1000;
+
+    for (gint64 now = g_get_monotonic_time(); now < deadline; now = g_get_monotonic_time()) {
+        char keys[32];
+        gboolean held = FALSE;
+
+        XQueryKeymap(dpy, keys);
+        for (size_t i = 0; i < sizeof(keys) && !held; ++i)
+            held = keys[i] != 0;
+
+        if (held)
+            idle_since = 0;
+        else if (!idle_since)
+            idle_since = now;
+        else if (now - idle_since >= KEYBOARD_IDLE_MS * 1000)
+            return;
+
+        g_usleep(KEYBOARD_IDLE_POLL_MS * 1000);
+    }
+}
+
+static void on_keymap_updated(gboolean success);
+
+static X11Op keymap_op = { "Keymap update", 0, 0, on_keymap_updated };
+
 static void mess_with_x11s_layout(gboolean remove)
 {
+    if (!keymap_reload && (keymap_reload = mmap(NULL, sizeof(KeymapReloadRec), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+        keymap_reload = NULL;
+    if (keymap_reload)
+        memset(keymap_reload, 0, sizeof(KeymapReloadRec));
+
     pid_t pid = fork();
 
     if (pid == 0) {
+        int ret = EXIT_FAILURE;
+
         if (setuid(orig_user) != -1) {
             // Taken from the Mutter source code
             int major = XkbMajorVersion, minor = XkbMinorVersion;
@@ -345,18 +804,28 @@ static void mess_with_x11s_layout(gboolean remove)
                         XkbComponentNamesRec xkb_comp_names = { 0 };
                         XkbRF_GetComponents(xkb_rules, &xkb_var_defs, &xkb_comp_names);
 
-                        XkbDescRec *xkb_desc = XkbGetKeyboardByName(dpy,
-                                                                    XkbUseCoreKbd,
-                                                                    &xkb_comp_names,
-                                                                    XkbGBN_AllComponentsMask,
-                                                                    XkbGBN_AllComponentsMask &
-                                                                    (~XkbGBN_GeometryMask), True);
+                        if (!remove)
+                            wait_for_keyboard_idle(dpy);
+
+                        // The keyboard's unusable while the server loads the new keymap
+                        gboolean reload = !keymap_reload || g_atomic_int_compare_and_exchange(&keymap_reload->state, KEYMAP_RELOAD_PENDING, KEYMAP_RELOAD_STARTED);
+                        if (reload && keymap_reload)
+                            keymap_reload->start = g_get_monotonic_time();
+                        XkbDescRec *xkb_desc = !reload ? NULL : XkbGetKeyboardByName(dpy,
+                                                                                     XkbUseCoreKbd,
+                                                                                     &xkb_comp_names,
+                                                                                     XkbGBN_AllComponentsMask,
+                                                                                     XkbGBN_AllComponentsMask &
+                                                                                     (~XkbGBN_GeometryMask), True);
+                        if (reload && keymap_reload)
+                            keymap_reload->end = g_get_monotonic_time();
 
                         if (xkb_desc) {
                             XkbFreeKeyboard(xkb_desc, 0, True);
                             gchar *rules_name = g_path_get_basename(rules_file_path);
                             XkbRF_SetNamesProp(dpy, rules_name, &xkb_var_defs);
                             g_free(rules_name);
+                            ret = EXIT_SUCCESS;
                         }
 
                         if (xkb_comp_names.keymap)
@@ -388,10 +857,129 @@ static void mess_with_x11s_layout(gboolean remove)
                 XCloseDisplay(dpy);
             }
         }
-        exit(EXIT_SUCCESS);
+        exit(ret);
     } else if (pid > 0) {
-        int status;
-        waitpid(pid, &status, 0);
+        x11_op_watch(&keymap_op, pid);
+    } else {
+        perror("Failed to fork() for keymap update");
+    }
+}
+
+static gboolean apply_expensive_state(gpointer user_data G_GNUC_UNUSED);
+
+static void schedule_expensive_state()
+{
+    // If a keymap update is still running, on_keymap_updated() picks the keymap up again once it's done
+    if (apply_source_id || keymap_op.pid)
+        return;
+
+    // Locking gets its keymap changed as soon as the signal burst is dealt with. Unlocking puts the
+    // keymap back at low priority after a short delay, as the user is likely typing right then.
+    if (desired_locked)
+        apply_source_id = g_idle_add(apply_expensive_state, NULL);
+    else
+        apply_source_id = g_timeout_add_full(G_PRIORITY_LOW, KEYMAP_RESTORE_DELAY_MS, apply_expensive_state, NULL, NULL);
+}
+
+static void on_keymap_updated(gboolean success)
+{
+    trace(success ? LOCK_TRACE_KEYMAP : LOCK_TRACE_KEYMAP_FAILED, applied_locked);
+
+    // A failed update could have left the keymap either way, so it stays JOURNAL_CHANGING
+    if (success && modify_x11_layout_options)
+        journal_set(JOURNAL_KEYMAP, applied_locked ? JOURNAL_HARDENED : JOURNAL_CLEAR);
+
+    if (success && !applied_locked && unlocked_at && keymap_reload)
+        g_debug("Input was back to normal %.1f ms after unlock, the keymap reload itself took %.1f ms",
+                (keymap_reload->end - unlocked_at) / 1000.0, (keymap_reload->end - keymap_reload->start) / 1000.0);
+
+    if (desired_locked != applied_locked)
+        schedule_expensive_state();
+}
+
+// A restore that hasn't started reloading yet can just be killed: the keymap is still the hardened one
+static gboolean cancel_keymap_restore()
+{
+    if (!keymap_op.pid || applied_locked || !keymap_reload)
+        return FALSE;
+
+    if (!g_atomic_int_compare_and_exchange(&keymap_reload->state, KEYMAP_RELOAD_PENDING, KEYMAP_RELOAD_CANCELLED))
+        return FALSE;
+
+    x11_op_abandon(&keymap_op);
+    applied_locked = TRUE;
+    journal_set(JOURNAL_KEYMAP, JOURNAL_HARDENED);
+
+    return TRUE;
+}
+
+static gboolean apply_expensive_state(gpointer user_data G_GNUC_UNUSED)
+{
+    apply_source_id = 0;
+
+    if (applied_locked != desired_locked) {
+        applied_locked = desired_locked;
+
+        if (modify_x11_layout_options) {
+            journal_set(JOURNAL_KEYMAP, JOURNAL_CHANGING);
+            mess_with_x11s_layout(applied_locked);
+        }
+    }
+
+    return G_SOURCE_REMOVE;
+}
+
+static void set_locked(gboolean locked)
+{
+    // The VT lock and sysrq are cheap and what actually matters for security, so always do them right away.
+    // So is the sound, which is tracked apart from the keymap: only the keymap is left for later.
+    if (!locked)
+        unlocked_at = g_get_monotonic_time();
+
+    journal_set(JOURNAL_VT, JOURNAL_CHANGING);
+    lock_vt(locked);
+    journal_set(JOURNAL_VT, locked ? JOURNAL_HARDENED : JOURNAL_CLEAR);
+    trace(LOCK_TRACE_VT, locked);
+
+    if (modify_sysrq) {
+        journal_set(JOURNAL_SYSRQ, JOURNAL_CHANGING);
+        write_sysrq(locked ? "0" : orig_sysrq);
+        journal_set(JOURNAL_SYSRQ, locked ? JOURNAL_HARDENED : JOURNAL_CLEAR);
+        trace(LOCK_TRACE_SYSRQ, locked);
+    }
+
+    if (!locked) {
+        unmute_sound();
+    } else {
+        // Muting is asynchronous and doesn't wait behind a keymap update that's still running. It's redone
+        // on every lock where our mute has been undone, even when the keymap never got to be restored.
+        if (!muted_sink)
+            mute_sound(FALSE);
+        if (cancel_keymap_restore())
+            g_debug("Called off a keymap restore that was still waiting for the keyboard");
+    }
+
+    // The keymap only ever goes to the latest state. It's changed from an idle source so that a burst of
+    // queued signals is fully dispatched first and only the final state of the burst is applied.
+    gboolean pending = apply_source_id || (keymap_op.pid && desired_locked != applied_locked);
+    desired_locked = locked;
+
+    if (desired_locked == applied_locked) {
+        if (apply_source_id) {
+            g_source_remove(apply_source_id);
+            apply_source_id = 0;
+        }
+        ++skipped_transitions;
+        if (pending)
+            g_debug("Cancelled a pending transition (%u skipped so far)", skipped_transitions);
+        else
+            g_debug("Already %s, nothing to do (%u skipped so far)", locked ? "locked" : "unlocked", skipped_transitions);
+    } else {
+        if (pending) {
+            ++skipped_transitions;
+            g_debug("Superseded a pending transition (%u skipped so far)", skipped_transitions);
+        }
+        schedule_expensive_state();
     }
 }
 
@@ -400,35 +988,44 @@ static void on_screensaver(GDBusProxy *proxy G_GNUC_UNUSED, gchar *sender_name G
     if (!g_strcmp0(signal_name, "Locked")) {
         gboolean locked;
         g_variant_get(parameters, "(b)", &locked);
+        trace(LOCK_TRACE_SCREENSAVER_LOCKED, locked);
 
-        if (locked) {
-	        lock_vt(TRUE);
-	        if (modify_sysrq)
-	            write_sysrq("0");
-	        if (modify_x11_layout_options)
-	            mess_with_x11s_layout(locked);
-	        if (locked)
-	            mute_sound(FALSE);
-    	}
+        if (locked)
+            set_locked(TRUE);
     } else if (!g_strcmp0(signal_name, "ActiveChanged")) {
         gboolean locked;
         g_variant_get(parameters, "(b)", &locked);
+        trace(LOCK_TRACE_SCREENSAVER_ACTIVE_CHANGED, locked);
 
-        if (!locked) {
-	        lock_vt(FALSE);
-	        if (modify_sysrq)
-	            write_sysrq(orig_sysrq);
-	        if (modify_x11_layout_options)
-	            mess_with_x11s_layout(FALSE);
-    	}
+        if (!locked)
+            set_locked(FALSE);
     }
 
 }
 
+// Bring a previous instance's leftovers in line with whether the screen is locked right now
+static void journal_recover()
+{
+    // If the screensaver can't say (it may well be restarting after whatever killed us), stay hardened
+    // until the next ActiveChanged(false) rather than risk unlocking things under a locked screen
+    gboolean locked = TRUE;
+    GVariant *res = g_dbus_proxy_call_sync(screensaver_proxy, "GetActive", NULL, G_DBUS_CALL_FLAGS_NONE, -1, NULL, NULL);
+
+    if (res) {
+        g_variant_get(res, "(b)", &locked);
+        g_variant_unref(res);
+    }
+
+    g_printerr("Recovering from an unclean exit: %s\n", locked ? "hardening again" : "rolling back");
+    set_locked(locked);
+}
+
 static void cleanup()
 {
     if (term != -1) {
+        journal_set(JOURNAL_VT, JOURNAL_CHANGING);
         lock_vt(FALSE);
+        journal_set(JOURNAL_VT, JOURNAL_CLEAR);
         g_close(term, NULL);
         term = -1;
     }
@@ -445,24 +1042,88 @@ static void cleanup()
         g_signal_handlers_disconnect_by_func(screensaver_proxy, on_screensaver, NULL);
         g_clear_object(&screensaver_proxy);
     }
+    if (apply_source_id) {
+        g_source_remove(apply_source_id);
+        apply_source_id = 0;
+    }
+    x11_op_cancel_watchdog(&keymap_op);
+    x11_op_cancel_watchdog(&xkillall_op);
+    g_debug("%u redundant keymap/audio transitions skipped", skipped_transitions);
     g_clear_pointer(&loop, g_main_loop_unref);
     g_clear_pointer(&extra_x11_layout_options, g_free);
+    journal_close();
+    if (keymap_reload) {
+        munmap(keymap_reload, sizeof(KeymapReloadRec));
+        keymap_reload = NULL;
+    }
+    trace_close();
+    g_clear_pointer(&trace_path, g_free);
 }
 
-int main()
+int main(int argc, char *argv[])
 {
-    // Drop privs to connect to user's session bus: thanks, https://stackoverflow.com/a/6732456
+    GOptionEntry entries[] = {
+        { "x11-timeout", 't', 0, G_OPTION_ARG_INT, &x11_timeout, "Seconds to give each X operation before killing it, 0 to wait forever (default: 10)", "SECONDS" },
+        { "trace", 0, 0, G_OPTION_ARG_FILENAME, &trace_path, "Record the signals received and what was done about them to FILE, for lock_replay", "FILE" },
+        { "dry-run", 'n', 0, G_OPTION_ARG_NONE, &dry_run, "Leave the VT and sysrq alone, and run without root or a state journal", NULL },
+        { NULL }
+    };
+    GOptionContext *context;
+    GError *error = NULL;
+
+    // Drop privs to connect to user's session bus (and before parsing any options): thanks, https://stackoverflow.com/a/6732456
     orig_user = getuid();
     if (seteuid(orig_user) == -1) {
         perror("failed to drop privs");
         return EXIT_FAILURE;
     }
 
-    if (!read_sysrq())
+    context = g_option_context_new(NULL);
+    g_option_context_add_main_entries(context, entries, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        g_printerr("%s\n", error->message);
+        g_error_free(error);
+        g_option_context_free(context);
         return EXIT_FAILURE;
-    modify_sysrq = orig_sysrq[0] != '0';
+    }
+    g_option_context_free(context);
 
-    modify_x11_layout_options = must_we_mess_with_x11s_layout(&extra_x11_layout_options);
+    if (x11_timeout < 0) {
+        g_printerr("--x11-timeout must not be negative\n");
+        return EXIT_FAILURE;
+    }
+
+    // For good, so neither we nor our children can ever get root back
+    if (dry_run && setresuid(orig_user, orig_user, orig_user) == -1) {
+        perror("failed to drop privs for good");
+        return EXIT_FAILURE;
+    }
+
+    // Created while we're still the user
+    if (trace_path && !trace_open())
+        return EXIT_FAILURE;
+
+    // A dry run hardens nothing, so it mustn't get a say in what the next real instance recovers
+    if (!dry_run) {
+        if (seteuid(0) == 0) {
+            journal_open();
+            if (seteuid(orig_user) == -1) {
+                perror("failed to drop privs");
+                return EXIT_FAILURE;
+            }
+        } else {
+            perror("Failed to regain root privs for the state journal");
+        }
+    }
+
+    if (!journal_load_originals()) {
+        if (!read_sysrq())
+            return EXIT_FAILURE;
+        modify_sysrq = orig_sysrq[0] != '0';
+
+        modify_x11_layout_options = must_we_mess_with_x11s_layout(&extra_x11_layout_options);
+        journal_save_originals();
+    }
 
     if (!(screensaver_proxy = g_dbus_proxy_new_for_bus_sync(G_BUS_TYPE_SESSION, G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES, NULL, "org.gnome.ScreenSaver", "/org/gnome/ScreenSaver", "org.gnome.ScreenSaver", NULL, NULL))) {
         g_printerr("Failed to connect to Screensaver interface on user's session\n");
@@ -478,12 +1139,18 @@ int main()
     gnome_session_register();
     upower_init();
 
-    if (seteuid(0) == -1) {
-        perror("Failed to regain root privs");
-        return EXIT_FAILURE;
+    if (!dry_run) {
+        if (seteuid(0) == -1) {
+            perror("Failed to regain root privs");
+            return EXIT_FAILURE;
+        }
+        setuid(0);
     }
-    setuid(0);
 
+    if (journal_recovered)
+        journal_recover();
+
+    trace(LOCK_TRACE_READY, TRUE);
     g_main_loop_run(loop);
 
     cleanup();
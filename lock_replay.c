@@ -0,0 +1,528 @@
+// cc -Wall -O2 `pkg-config --cflags --libs gio-2.0` lock_replay.c -o lock_replay
+
+/*
+	Plays a trace recorded with lock_helper --trace back against a lock_helper --dry-run on a private bus
+
+	The private bus stands in for both the session and system buses, with just enough of GNOME Screensaver,
+	UPower and gnome-session on it for lock_helper to talk to. Once it's done, lock_helper's own trace of
+	the replay is used to report how long each signal took to deal with and what was left hardened.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+
+#include "lock_trace.h"
+
+#define CLIENT_PATH "/org/gnome/SessionManager/Client1"
+// How long lock_helper gets to register with the (fake) session manager and start listening
+#define READY_TIMEOUT_MS 10000
+#define READY_POLL_MS 10
+
+static const gchar introspection_xml[] =
+    "<node>"
+    "  <interface name='org.gnome.ScreenSaver'>"
+    "    <method name='Lock'/>"
+    "    <method name='GetActive'><arg type='b' direction='out'/></method>"
+    "    <signal name='ActiveChanged'><arg type='b'/></signal>"
+    "    <signal name='Locked'><arg type='b'/></signal>"
+    "  </interface>"
+    "  <interface name='org.freedesktop.UPower'>"
+    "    <property name='LidIsClosed' type='b' access='read'/>"
+    "  </interface>"
+    "  <interface name='org.gnome.SessionManager'>"
+    "    <method name='RegisterClient'><arg type='s' direction='in'/><arg type='s' direction='in'/><arg type='o' direction='out'/></method>"
+    "    <method name='UnregisterClient'><arg type='o' direction='in'/></method>"
+    "  </interface>"
+    "  <interface name='org.gnome.SessionManager.ClientPrivate'>"
+    "    <method name='EndSessionResponse'><arg type='b' direction='in'/><arg type='s' direction='in'/></method>"
+    "    <signal name='Stop'/>"
+    "    <signal name='QueryEndSession'><arg type='u'/></signal>"
+    "    <signal name='EndSession'><arg type='u'/></signal>"
+    "  </interface>"
+    "</node>";
+
+typedef struct {
+    gchar *contents;
+    const LockTraceHeader *header;
+    const LockTraceRec *recs;
+    gsize n_recs;
+} LockTrace;
+
+static gdouble speed = 1.0;
+static gint settle_ms = 4000;
+static gchar *display = NULL;
+static gchar *output_path = NULL;
+
+static GMainLoop *loop = NULL;
+static GDBusConnection *bus = NULL;
+static gboolean screensaver_active = FALSE;
+static gboolean lid_closed = FALSE;
+
+static LockTrace input;
+static gint64 *sent_at = NULL;
+static gsize next_rec = 0;
+static gint64 replay_start = 0;
+
+static GPid helper_pid = 0;
+static gboolean helper_exited = FALSE;
+static gchar *helper_trace_path = NULL;
+static guint timer_id = 0;
+
+static const gchar *event_name(guint16 event)
+{
+    switch (event) {
+        case LOCK_TRACE_SCREENSAVER_LOCKED: return "ScreenSaver.Locked";
+        case LOCK_TRACE_SCREENSAVER_ACTIVE_CHANGED: return "ScreenSaver.ActiveChanged";
+        case LOCK_TRACE_UPOWER_LID_CLOSED: return "UPower.LidIsClosed";
+        case LOCK_TRACE_SESSION_QUERY_END: return "SessionManager.QueryEndSession";
+        case LOCK_TRACE_SESSION_END: return "SessionManager.EndSession";
+        case LOCK_TRACE_SESSION_STOP: return "SessionManager.Stop";
+        case LOCK_TRACE_READY: return "ready";
+        case LOCK_TRACE_PULSE_READY: return "pulse";
+        case LOCK_TRACE_VT: return "vt";
+        case LOCK_TRACE_SYSRQ: return "sysrq";
+        case LOCK_TRACE_KEYMAP: return "keymap";
+        case LOCK_TRACE_KEYMAP_FAILED: return "keymap update failed";
+        case LOCK_TRACE_MUTE: return "sound";
+        case LOCK_TRACE_LOCK_CALLED: return "Lock() returned";
+        case LOCK_TRACE_END_SESSION_RESPONSE: return "EndSessionResponse() returned";
+        default: return "unknown";
+    }
+}
+
+static const gchar *step_state(guint16 event, guint16 arg)
+{
+    switch (event) {
+        case LOCK_TRACE_PULSE_READY: return arg ? "connected" : "disconnected";
+        case LOCK_TRACE_MUTE: return arg ? "muted" : "unmuted";
+        case LOCK_TRACE_VT:
+        case LOCK_TRACE_SYSRQ:
+        case LOCK_TRACE_KEYMAP:
+        case LOCK_TRACE_KEYMAP_FAILED: return arg ? "hardened" : "restored";
+        default: return "";
+    }
+}
+
+static gboolean is_signal(const LockTraceRec *rec)
+{
+    return rec->event >= LOCK_TRACE_SCREENSAVER_LOCKED && rec->event <= LOCK_TRACE_LAST_SIGNAL;
+}
+
+static gboolean trace_load(const gchar *path, LockTrace *trace)
+{
+    gsize len;
+    GError *error = NULL;
+
+    memset(trace, 0, sizeof(*trace));
+
+    if (!g_file_get_contents(path, &trace->contents, &len, &error)) {
+        g_printerr("%s\n", error->message);
+        g_error_free(error);
+        return FALSE;
+    }
+
+    if (len < sizeof(LockTraceHeader) || memcmp(trace->contents, LOCK_TRACE_MAGIC, sizeof(trace->header->magic))) {
+        g_printerr("%s isn't a lock_helper trace\n", path);
+        g_clear_pointer(&trace->contents, g_free);
+        return FALSE;
+    }
+
+    // A partial record at the end is what's left of a crash: ignore it
+    trace->header = (const LockTraceHeader *) trace->contents;
+    trace->recs = (const LockTraceRec *) (trace->contents + sizeof(LockTraceHeader));
+    trace->n_recs = (len - sizeof(LockTraceHeader)) / sizeof(LockTraceRec);
+
+    return TRUE;
+}
+
+// How long it took to finish dealing with the signal at index i: up to the last step before the next signal
+static gint64 settle_time(const LockTrace *trace, gsize i)
+{
+    gint64 last = trace->recs[i].time;
+
+    for (gsize j = i + 1; j < trace->n_recs && !is_signal(&trace->recs[j]); ++j)
+        if (trace->recs[j].event != LOCK_TRACE_READY && trace->recs[j].event != LOCK_TRACE_PULSE_READY)
+            last = trace->recs[j].time;
+
+    return last - trace->recs[i].time;
+}
+
+static void on_method_call(GDBusConnection *connection G_GNUC_UNUSED, const gchar *sender G_GNUC_UNUSED, const gchar *object_path G_GNUC_UNUSED, const gchar *interface_name G_GNUC_UNUSED, const gchar *method_name, GVariant *parameters G_GNUC_UNUSED, GDBusMethodInvocation *invocation, gpointer user_data G_GNUC_UNUSED)
+{
+    // Lock() doesn't do anything here: the signals the real thing sent in response are in the trace
+    if (!g_strcmp0(method_name, "GetActive"))
+        g_dbus_method_invocation_return_value(invocation, g_variant_new("(b)", screensaver_active));
+    else if (!g_strcmp0(method_name, "RegisterClient"))
+        g_dbus_method_invocation_return_value(invocation, g_variant_new("(o)", CLIENT_PATH));
+    else
+        g_dbus_method_invocation_return_value(invocation, NULL);
+}
+
+static GVariant *on_get_property(GDBusConnection *connection G_GNUC_UNUSED, const gchar *sender G_GNUC_UNUSED, const gchar *object_path G_GNUC_UNUSED, const gchar *interface_name G_GNUC_UNUSED, const gchar *property_name G_GNUC_UNUSED, GError **error G_GNUC_UNUSED, gpointer user_data G_GNUC_UNUSED)
+{
+    return g_variant_new_boolean(lid_closed);
+}
+
+static const GDBusInterfaceVTable vtable = { on_method_call, on_get_property, NULL, { 0 } };
+
+static gboolean export_services()
+{
+    static const struct {
+        const gchar *name;
+        const gchar *path;
+        const gchar *interface;
+    } objects[] = {
+        { "org.gnome.ScreenSaver", "/org/gnome/ScreenSaver", "org.gnome.ScreenSaver" },
+        { "org.freedesktop.UPower", "/org/freedesktop/UPower", "org.freedesktop.UPower" },
+        { "org.gnome.SessionManager", "/org/gnome/SessionManager", "org.gnome.SessionManager" },
+        { NULL, CLIENT_PATH, "org.gnome.SessionManager.ClientPrivate" }
+    };
+    GDBusNodeInfo *info = g_dbus_node_info_new_for_xml(introspection_xml, NULL);
+    gboolean ret = TRUE;
+
+    for (gsize i = 0; i < G_N_ELEMENTS(objects) && ret; ++i) {
+        GError *error = NULL;
+
+        if (!g_dbus_connection_register_object(bus, objects[i].path, g_dbus_node_info_lookup_interface(info, objects[i].interface), &vtable, NULL, NULL, &error)) {
+            g_printerr("Failed to export %s: %s\n", objects[i].interface, error->message);
+            g_error_free(error);
+            ret = FALSE;
+        } else if (objects[i].name) {
+            GVariant *res = g_dbus_connection_call_sync(bus, "org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus", "RequestName", g_variant_new("(su)", objects[i].name, 0), G_VARIANT_TYPE("(u)"), G_DBUS_CALL_FLAGS_NONE, -1, NULL, &error);
+
+            if (res) {
+                g_variant_unref(res);
+            } else {
+                g_printerr("Failed to own %s: %s\n", objects[i].name, error->message);
+                g_error_free(error);
+                ret = FALSE;
+            }
+        }
+    }
+
+    g_dbus_node_info_unref(info);
+    return ret;
+}
+
+static void emit(const LockTraceRec *rec)
+{
+    switch (rec->event) {
+        case LOCK_TRACE_SCREENSAVER_LOCKED:
+            g_dbus_connection_emit_signal(bus, NULL, "/org/gnome/ScreenSaver", "org.gnome.ScreenSaver", "Locked", g_variant_new("(b)", rec->arg), NULL);
+            break;
+        case LOCK_TRACE_SCREENSAVER_ACTIVE_CHANGED:
+            screensaver_active = rec->arg;
+            g_dbus_connection_emit_signal(bus, NULL, "/org/gnome/ScreenSaver", "org.gnome.ScreenSaver", "ActiveChanged", g_variant_new("(b)", rec->arg), NULL);
+            break;
+        case LOCK_TRACE_UPOWER_LID_CLOSED: {
+            GVariantBuilder changed;
+
+            lid_closed = rec->arg;
+            g_variant_builder_init(&changed, G_VARIANT_TYPE("a{sv}"));
+            g_variant_builder_add(&changed, "{sv}", "LidIsClosed", g_variant_new_boolean(lid_closed));
+            g_dbus_connection_emit_signal(bus, NULL, "/org/freedesktop/UPower", "org.freedesktop.DBus.Properties", "PropertiesChanged", g_variant_new("(sa{sv}as)", "org.freedesktop.UPower", &changed, NULL), NULL);
+            break;
+        }
+        case LOCK_TRACE_SESSION_QUERY_END:
+            g_dbus_connection_emit_signal(bus, NULL, CLIENT_PATH, "org.gnome.SessionManager.ClientPrivate", "QueryEndSession", g_variant_new("(u)", 0), NULL);
+            break;
+        case LOCK_TRACE_SESSION_END:
+            g_dbus_connection_emit_signal(bus, NULL, CLIENT_PATH, "org.gnome.SessionManager.ClientPrivate", "EndSession", g_variant_new("(u)", 0), NULL);
+            break;
+        case LOCK_TRACE_SESSION_STOP:
+            g_dbus_connection_emit_signal(bus, NULL, CLIENT_PATH, "org.gnome.SessionManager.ClientPrivate", "Stop", NULL, NULL);
+            break;
+    }
+
+    g_dbus_connection_flush_sync(bus, NULL, NULL);
+}
+
+static gboolean on_settled(gpointer user_data G_GNUC_UNUSED)
+{
+    timer_id = 0;
+    if (!helper_exited)
+        kill(helper_pid, SIGTERM);
+
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean replay_next(gpointer user_data G_GNUC_UNUSED);
+
+static void schedule_next()
+{
+    while (next_rec < input.n_recs && !is_signal(&input.recs[next_rec]))
+        ++next_rec;
+
+    if (next_rec == input.n_recs) {
+        timer_id = g_timeout_add(settle_ms, on_settled, NULL);
+        return;
+    }
+
+    // Relative to the start of the replay rather than the previous signal, so lateness doesn't add up
+    gint64 due = replay_start;
+    if (speed > 0)
+        due += (input.recs[next_rec].time - input.recs[0].time) / speed;
+
+    gint64 delay = due - g_get_monotonic_time();
+    timer_id = g_timeout_add(delay > 0 ? delay / 1000 : 0, replay_next, NULL);
+}
+
+static gboolean replay_next(gpointer user_data G_GNUC_UNUSED)
+{
+    timer_id = 0;
+    if (helper_exited)
+        return G_SOURCE_REMOVE;
+
+    sent_at[next_rec] = g_get_monotonic_time();
+    emit(&input.recs[next_rec]);
+    ++next_rec;
+    schedule_next();
+
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean wait_for_ready(gpointer user_data G_GNUC_UNUSED)
+{
+    static gint waited = 0;
+    LockTrace trace;
+
+    if (helper_exited) {
+        timer_id = 0;
+        return G_SOURCE_REMOVE;
+    }
+
+    if (trace_load(helper_trace_path, &trace)) {
+        for (gsize i = 0; i < trace.n_recs; ++i) {
+            if (trace.recs[i].event == LOCK_TRACE_READY) {
+                g_free(trace.contents);
+                timer_id = 0;
+                replay_start = g_get_monotonic_time();
+                schedule_next();
+                return G_SOURCE_REMOVE;
+            }
+        }
+        g_free(trace.contents);
+    }
+
+    if ((waited += READY_POLL_MS) >= READY_TIMEOUT_MS) {
+        g_printerr("lock_helper didn't become ready within %d ms\n", READY_TIMEOUT_MS);
+        timer_id = 0;
+        kill(helper_pid, SIGTERM);
+        return G_SOURCE_REMOVE;
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+static void on_helper_exited(GPid pid, gint status G_GNUC_UNUSED, gpointer user_data G_GNUC_UNUSED)
+{
+    g_spawn_close_pid(pid);
+    helper_exited = TRUE;
+    g_main_loop_quit(loop);
+}
+
+static gboolean spawn_helper(gchar **helper_argv, gint helper_argc, const gchar *address)
+{
+    gchar **argv = g_new0(gchar *, helper_argc + 3);
+    gchar **envp = g_get_environ();
+    GError *error = NULL;
+    gboolean ret;
+
+    argv[0] = helper_argv[0];
+    argv[1] = "--dry-run";
+    argv[2] = g_strdup_printf("--trace=%s", helper_trace_path);
+    for (gint i = 1; i < helper_argc; ++i)
+        argv[i + 2] = helper_argv[i];
+
+    envp = g_environ_setenv(envp, "DBUS_SESSION_BUS_ADDRESS", address, TRUE);
+    envp = g_environ_setenv(envp, "DBUS_SYSTEM_BUS_ADDRESS", address, TRUE);
+    envp = g_environ_unsetenv(envp, "DBUS_STARTER_ADDRESS");
+    envp = g_environ_setenv(envp, "DESKTOP_AUTOSTART_ID", "lock_replay", TRUE);
+    // Keep it away from the real sound server, and from the real X server unless asked otherwise
+    envp = g_environ_setenv(envp, "PULSE_SERVER", "unix:/nonexistent", TRUE);
+    if (display)
+        envp = g_environ_setenv(envp, "DISPLAY", display, TRUE);
+    else
+        envp = g_environ_unsetenv(envp, "DISPLAY");
+
+    if (!(ret = g_spawn_async(NULL, argv, envp, G_SPAWN_DO_NOT_REAP_CHILD, NULL, NULL, &helper_pid, &error))) {
+        g_printerr("Failed to start %s: %s\n", argv[0], error->message);
+        g_error_free(error);
+    } else {
+        g_child_watch_add(helper_pid, on_helper_exited, NULL);
+    }
+
+    g_free(argv[2]);
+    g_free(argv);
+    g_strfreev(envp);
+
+    return ret;
+}
+
+static void report()
+{
+    LockTrace replayed;
+    gboolean *matched;
+    const LockTraceRec *last_step[LOCK_TRACE_END_SESSION_RESPONSE + 1] = { NULL };
+    guint failures = 0;
+
+    if (!trace_load(helper_trace_path, &replayed))
+        return;
+    matched = g_new0(gboolean, replayed.n_recs);
+
+    g_print("%-4s %-34s %12s %12s %12s\n", "#", "signal", "delivery", "recorded", "replayed");
+
+    for (gsize i = 0, n = 0; i < input.n_recs; ++i) {
+        const LockTraceRec *rec = &input.recs[i];
+        gsize j;
+
+        if (!is_signal(rec))
+            continue;
+        ++n;
+
+        gchar *name = g_strdup_printf("%s(%s)", event_name(rec->event), rec->arg ? "true" : "false");
+
+        if (!sent_at[i]) {
+            g_print("%-4" G_GSIZE_FORMAT " %-34s %12s\n", n, name, "not sent");
+            g_free(name);
+            continue;
+        }
+
+        // Signals on the session and system buses can overtake each other, so match by what they are
+        for (j = 0; j < replayed.n_recs; ++j)
+            if (!matched[j] && replayed.recs[j].event == rec->event && replayed.recs[j].arg == rec->arg)
+                break;
+
+        if (j == replayed.n_recs) {
+            g_print("%-4" G_GSIZE_FORMAT " %-34s %12s\n", n, name, "not received");
+            g_free(name);
+            continue;
+        }
+        matched[j] = TRUE;
+
+        gint64 received_at = replayed.header->start + replayed.recs[j].time;
+        g_print("%-4" G_GSIZE_FORMAT " %-34s %9.2f ms %9.2f ms %9.2f ms\n", n, name,
+                (received_at - sent_at[i]) / 1000.0, settle_time(&input, i) / 1000.0, settle_time(&replayed, j) / 1000.0);
+        g_free(name);
+
+        for (gsize k = j + 1; k < replayed.n_recs && !is_signal(&replayed.recs[k]); ++k)
+            g_print("%-4s   +%9.2f ms  %s %s\n", "", (replayed.recs[k].time - replayed.recs[j].time) / 1000.0,
+                    event_name(replayed.recs[k].event), step_state(replayed.recs[k].event, replayed.recs[k].arg));
+    }
+
+    for (gsize i = 0; i < replayed.n_recs; ++i) {
+        const LockTraceRec *rec = &replayed.recs[i];
+
+        if (rec->event == LOCK_TRACE_KEYMAP_FAILED)
+            ++failures;
+        else if (rec->event < G_N_ELEMENTS(last_step))
+            last_step[rec->event] = rec;
+    }
+
+    g_print("\nFinal state:");
+    for (guint16 event = LOCK_TRACE_VT; event <= LOCK_TRACE_MUTE; ++event) {
+        if (event == LOCK_TRACE_KEYMAP_FAILED)
+            continue;
+        g_print(" %s %s", event_name(event), last_step[event] ? step_state(event, last_step[event]->arg) : "untouched");
+    }
+    g_print("\nFailed keymap updates: %u\n", failures);
+
+    g_free(matched);
+    g_free(replayed.contents);
+}
+
+int main(int argc, char *argv[])
+{
+    GOptionEntry entries[] = {
+        { "speed", 's', 0, G_OPTION_ARG_DOUBLE, &speed, "Play back FACTOR times faster than recorded, 0 for no delays (default: 1)", "FACTOR" },
+        { "settle", 'S', 0, G_OPTION_ARG_INT, &settle_ms, "Give lock_helper MS to finish after the last signal (default: 4000)", "MS" },
+        { "display", 'd', 0, G_OPTION_ARG_STRING, &display, "Let lock_helper change the keymap of X display DISPLAY, which should be a scratch one (default: none)", "DISPLAY" },
+        { "output", 'o', 0, G_OPTION_ARG_FILENAME, &output_path, "Keep lock_helper's trace of the replay in FILE", "FILE" },
+        { NULL }
+    };
+    GOptionContext *context = g_option_context_new("TRACE LOCK_HELPER [LOCK_HELPER_OPTION…]");
+    GError *error = NULL;
+    GTestDBus *test_bus = NULL;
+    gchar *trace_dir = NULL;
+    int ret = EXIT_FAILURE;
+
+    // Everything after LOCK_HELPER is its own
+    g_option_context_set_strict_posix(context, TRUE);
+    g_option_context_add_main_entries(context, entries, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        g_printerr("%s\n", error->message);
+        g_error_free(error);
+        g_option_context_free(context);
+        return EXIT_FAILURE;
+    }
+    g_option_context_free(context);
+
+    if (argc < 3 || speed < 0 || settle_ms < 0) {
+        g_printerr("Usage: %s [OPTION…] TRACE LOCK_HELPER [LOCK_HELPER_OPTION…]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (!trace_load(argv[1], &input))
+        return EXIT_FAILURE;
+    sent_at = g_new0(gint64, input.n_recs);
+
+    if (!(trace_dir = g_dir_make_tmp("lock_replay-XXXXXX", &error))) {
+        g_printerr("%s\n", error->message);
+        g_error_free(error);
+        goto out;
+    }
+    helper_trace_path = output_path ? g_strdup(output_path) : g_build_filename(trace_dir, "replay.trace", NULL);
+
+    test_bus = g_test_dbus_new(G_TEST_DBUS_NONE);
+    g_test_dbus_up(test_bus);
+
+    if (!(bus = g_dbus_connection_new_for_address_sync(g_test_dbus_get_bus_address(test_bus), G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT | G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION, NULL, NULL, &error))) {
+        g_printerr("Failed to connect to the private bus: %s\n", error->message);
+        g_error_free(error);
+        goto out;
+    }
+
+    if (!export_services() || !spawn_helper(argv + 2, argc - 2, g_test_dbus_get_bus_address(test_bus)))
+        goto out;
+
+    loop = g_main_loop_new(NULL, FALSE);
+    timer_id = g_timeout_add(READY_POLL_MS, wait_for_ready, NULL);
+    g_main_loop_run(loop);
+
+    if (timer_id)
+        g_source_remove(timer_id);
+
+    if (speed > 0)
+        g_print("Replayed %s at %gx speed\n\n", argv[1], speed);
+    else
+        g_print("Replayed %s with no delays\n\n", argv[1]);
+    report();
+    ret = EXIT_SUCCESS;
+
+out:
+    g_clear_object(&bus);
+    if (test_bus) {
+        g_test_dbus_down(test_bus);
+        g_object_unref(test_bus);
+    }
+    if (trace_dir) {
+        if (!output_path)
+            g_unlink(helper_trace_path);
+        g_rmdir(trace_dir);
+    }
+    g_clear_pointer(&loop, g_main_loop_unref);
+    g_free(helper_trace_path);
+    g_free(trace_dir);
+    g_free(sent_at);
+    g_free(input.contents);
+    g_free(display);
+    g_free(output_path);
+
+    return ret;
+}
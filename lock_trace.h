@@ -0,0 +1,53 @@
+#ifndef LOCK_TRACE_H
+#define LOCK_TRACE_H
+
+/*
+	On-disk format of the traces written by lock_helper --trace and played back by lock_replay
+
+	A LockTraceHeader followed by LockTraceRecs, all in host byte order
+*/
+
+#include <glib.h>
+
+#define LOCK_TRACE_MAGIC "LHTRACE1"
+
+enum {
+    // Signals lock_helper received, which is what lock_replay plays back. arg is the signal's boolean, if it has one.
+    LOCK_TRACE_SCREENSAVER_LOCKED = 1,
+    LOCK_TRACE_SCREENSAVER_ACTIVE_CHANGED,
+    LOCK_TRACE_UPOWER_LID_CLOSED,
+    LOCK_TRACE_SESSION_QUERY_END,
+    LOCK_TRACE_SESSION_END,
+    LOCK_TRACE_SESSION_STOP,
+    LOCK_TRACE_LAST_SIGNAL = LOCK_TRACE_SESSION_STOP,
+
+    // What lock_helper did about them. arg is TRUE for hardening (or muting), FALSE for putting things back.
+    LOCK_TRACE_READY = 64,
+    LOCK_TRACE_PULSE_READY,
+    LOCK_TRACE_VT,
+    LOCK_TRACE_SYSRQ,
+    LOCK_TRACE_KEYMAP,
+    LOCK_TRACE_KEYMAP_FAILED,
+    LOCK_TRACE_MUTE,
+    LOCK_TRACE_LOCK_CALLED,
+    LOCK_TRACE_END_SESSION_RESPONSE
+};
+
+typedef struct {
+    char magic[8];
+    // g_get_monotonic_time() when the trace was started, so traces from different processes line up
+    gint64 start;
+} LockTraceHeader;
+
+typedef struct {
+    // Microseconds since LockTraceHeader.start
+    gint64 time;
+    guint16 event;
+    guint16 arg;
+    guint32 padding;
+} LockTraceRec;
+
+G_STATIC_ASSERT(sizeof(LockTraceHeader) == 16);
+G_STATIC_ASSERT(sizeof(LockTraceRec) == 16);
+
+#endif